@@ -14,13 +14,18 @@
   permissions and limitations under the License.
 */
 
+// glibc only exposes TCP_QUICKACK, TCP_KEEPIDLE and the other
+// non-POSIX TCP options in <netinet/tcp.h> if this is defined
+#define _DEFAULT_SOURCE
+
 #include <unistd.h>       // for close, fcntl, unlink, write and ssize_t
 
 #include <sys/types.h>    // for socket, connect, getaddrinfo, accept and getsockopt
 #include <sys/stat.h>     // for fstat
-#include <sys/socket.h>   // for socket, connect, getaddrinfo, accept, shutdown and getsockopt
+#include <sys/socket.h>   // for socket, connect, getaddrinfo, accept, shutdown, getsockopt and setsockopt
 #include <sys/un.h>       // for sockaddr_un
-#include <netinet/in.h>   // for sockaddr_in and sockaddr_in6
+#include <netinet/in.h>   // for sockaddr_in, sockaddr_in6 and IPPROTO_TCP
+#include <netinet/tcp.h>  // for TCP_NODELAY and other TCP level socket options
 #include <arpa/inet.h>    // for htons and inet_pton
 #include <netdb.h>        // for getaddrinfo
 #include <fcntl.h>        // for fcntl
@@ -57,6 +62,104 @@ int ss_check_sock_error(int fd) {
   return val;
 }
 
+// these are the option codes passed in the 'opts' array of the
+// connect, listen and accept functions below.  They must be kept in
+// step with socket-option-codes in common.ss, which checks against
+// ss_socket_option_count() that the two have the same length
+enum {
+  SS_OPT_TCP_NODELAY = 0,
+  SS_OPT_TCP_QUICKACK,
+  SS_OPT_SO_SNDBUF,
+  SS_OPT_SO_RCVBUF,
+  SS_OPT_SO_BUSY_POLL,
+  SS_OPT_TCP_NOTSENT_LOWAT,
+  SS_OPT_TCP_DEFER_ACCEPT,
+  SS_OPT_SO_KEEPALIVE,
+  SS_OPT_TCP_KEEPIDLE,
+  SS_OPT_TCP_KEEPINTVL,
+  SS_OPT_TCP_KEEPCNT,
+  SS_OPT_END
+};
+
+int ss_socket_option_count(void) {
+  return SS_OPT_END;
+}
+
+// arguments: opts is an array of 'count' pairs of native ints, the
+// first of each pair being one of the SS_OPT_* codes above and the
+// second its value.  The options are applied in order, so a later
+// pair for the same option overrides an earlier one.  If is_tcp is
+// false, TCP level options are skipped.  Options which this platform
+// does not provide are also skipped.  When used by the accept
+// functions, the options are applied on top of those which the
+// kernel has already copied to the connection socket from the
+// listening socket.
+
+// return value: 1 on success, or 0 if setsockopt() fails or an option
+// code is invalid, with errno set.
+static int apply_socket_options(int sock, const unsigned char* opts,
+				int count, int is_tcp) {
+  int i;
+  for (i = 0; i < count; ++i) {
+    // the array comes from a scheme bytevector, so copy out to avoid
+    // any question of alignment
+    int pair[2];
+    memcpy(pair, opts + i * sizeof(pair), sizeof(pair));
+
+    int level;
+    int name;
+    switch (pair[0]) {
+    case SS_OPT_TCP_NODELAY:
+      level = IPPROTO_TCP; name = TCP_NODELAY; break;
+#ifdef TCP_QUICKACK
+    case SS_OPT_TCP_QUICKACK:
+      level = IPPROTO_TCP; name = TCP_QUICKACK; break;
+#endif
+    case SS_OPT_SO_SNDBUF:
+      level = SOL_SOCKET; name = SO_SNDBUF; break;
+    case SS_OPT_SO_RCVBUF:
+      level = SOL_SOCKET; name = SO_RCVBUF; break;
+#ifdef SO_BUSY_POLL
+    case SS_OPT_SO_BUSY_POLL:
+      level = SOL_SOCKET; name = SO_BUSY_POLL; break;
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    case SS_OPT_TCP_NOTSENT_LOWAT:
+      level = IPPROTO_TCP; name = TCP_NOTSENT_LOWAT; break;
+#endif
+#ifdef TCP_DEFER_ACCEPT
+    case SS_OPT_TCP_DEFER_ACCEPT:
+      level = IPPROTO_TCP; name = TCP_DEFER_ACCEPT; break;
+#endif
+    case SS_OPT_SO_KEEPALIVE:
+      level = SOL_SOCKET; name = SO_KEEPALIVE; break;
+#ifdef TCP_KEEPIDLE
+    case SS_OPT_TCP_KEEPIDLE:
+      level = IPPROTO_TCP; name = TCP_KEEPIDLE; break;
+#endif
+#ifdef TCP_KEEPINTVL
+    case SS_OPT_TCP_KEEPINTVL:
+      level = IPPROTO_TCP; name = TCP_KEEPINTVL; break;
+#endif
+#ifdef TCP_KEEPCNT
+    case SS_OPT_TCP_KEEPCNT:
+      level = IPPROTO_TCP; name = TCP_KEEPCNT; break;
+#endif
+    default:
+      if (pair[0] < 0 || pair[0] >= SS_OPT_END) {
+	errno = EINVAL;
+	return 0;
+      }
+      // a valid option which this platform does not provide
+      continue;
+    }
+    if (level == IPPROTO_TCP && !is_tcp) continue;
+    if (setsockopt(sock, level, name, &pair[1], sizeof(int)) == -1)
+      return 0;
+  }
+  return 1;
+}
+
 // It is almost always a mistake not to ignore or otherwise deal with
 // SIGPIPE in programs using sockets.  This function is a utility
 // which if called will cause SIGPIPE to be ignored: instead any
@@ -76,13 +179,17 @@ int ss_set_ignore_sigpipe() {
 // the service argument.  The service argument may be NULL, in which
 // case a port number greater than 0 must be given.  If 'blocking' is
 // false, the file descriptor is set non-blocking and this function
-// will return before the connection is made.
+// will return before the connection is made.  opts is an array of
+// opts_count option pairs to be applied to the socket before
+// connecting (see apply_socket_options()), or NULL.
 
 // return value: file descriptor of socket, or -1 on failure to look
 // up address, -2 on failure to construct a socket, -3 on a failure to
-// connect with blocking true.
+// connect with blocking true, and -4 on a failure to set the socket
+// options.
 int ss_connect_to_ipv4_host_impl(const char* address, const char* service,
-				 unsigned short port, int blocking) {
+				 unsigned short port, int blocking,
+				 const unsigned char* opts, int opts_count) {
 
   struct addrinfo hints;
   memset(&hints, 0, sizeof(hints));
@@ -92,6 +199,7 @@ int ss_connect_to_ipv4_host_impl(const char* address, const char* service,
   // getaddrinfo and connect may show latency - release the GC
   Slock_object((void*)address);
   if (service) Slock_object((void*)service);
+  if (opts) Slock_object((void*)opts);
   Sdeactivate_thread();
 
   struct addrinfo* info;
@@ -102,6 +210,7 @@ int ss_connect_to_ipv4_host_impl(const char* address, const char* service,
     Sactivate_thread();
     Sunlock_object((void*)address);
     if (service) Sunlock_object((void*)service);
+    if (opts) Sunlock_object((void*)opts);
     errno = saved_errno;
     return -1;
   }
@@ -133,6 +242,13 @@ int ss_connect_to_ipv4_host_impl(const char* address, const char* service,
       break;
     }
 
+    if (opts && !apply_socket_options(sock, opts, opts_count, 1)) {
+      saved_errno = errno;
+      close(sock);
+      err = -4;
+      break;
+    }
+
     struct sockaddr* in = tmp->ai_addr;
     // if we passed NULL to the service argument of getaddrinfo, we
     // have to set the port number by hand or connect will fail
@@ -154,6 +270,7 @@ int ss_connect_to_ipv4_host_impl(const char* address, const char* service,
   Sactivate_thread();
   Sunlock_object((void*)address);
   if (service) Sunlock_object((void*)service);
+  if (opts) Sunlock_object((void*)opts);
   freeaddrinfo(info);
   errno = saved_errno;
 
@@ -166,13 +283,17 @@ int ss_connect_to_ipv4_host_impl(const char* address, const char* service,
 // the service argument.  The service argument may be NULL, in which
 // case a port number greater than 0 must be given.  If 'blocking' is
 // false, the file descriptor is set non-blocking and this function
-// will return before the connection is made.
+// will return before the connection is made.  opts is an array of
+// opts_count option pairs to be applied to the socket before
+// connecting (see apply_socket_options()), or NULL.
 
 // return value: file descriptor of socket, or -1 on failure to look
 // up address, -2 on failure to construct a socket, -3 on a failure to
-// connect with blocking true.
+// connect with blocking true, and -4 on a failure to set the socket
+// options.
 int ss_connect_to_ipv6_host_impl(const char* address, const char* service,
-				 unsigned short port, int blocking) {
+				 unsigned short port, int blocking,
+				 const unsigned char* opts, int opts_count) {
 
   struct addrinfo hints;
   memset(&hints, 0, sizeof(hints));
@@ -182,6 +303,7 @@ int ss_connect_to_ipv6_host_impl(const char* address, const char* service,
   // getaddrinfo and connect may show latency - release the GC
   Slock_object((void*)address);
   if (service) Slock_object((void*)service);
+  if (opts) Slock_object((void*)opts);
   Sdeactivate_thread();
 
   struct addrinfo* info;
@@ -192,6 +314,7 @@ int ss_connect_to_ipv6_host_impl(const char* address, const char* service,
     Sactivate_thread();
     Sunlock_object((void*)address);
     if (service) Sunlock_object((void*)service);
+    if (opts) Sunlock_object((void*)opts);
     errno = saved_errno;
     return -1;
   }
@@ -222,7 +345,14 @@ int ss_connect_to_ipv6_host_impl(const char* address, const char* service,
       err = -2;
       break;
     }
-    
+
+    if (opts && !apply_socket_options(sock, opts, opts_count, 1)) {
+      saved_errno = errno;
+      close(sock);
+      err = -4;
+      break;
+    }
+
     struct sockaddr* in = tmp->ai_addr;
     // if we passed NULL to the service argument of getaddrinfo, we
     // have to set the port number by hand or connect will fail
@@ -244,6 +374,7 @@ int ss_connect_to_ipv6_host_impl(const char* address, const char* service,
   Sactivate_thread();
   Sunlock_object((void*)address);
   if (service) Sunlock_object((void*)service);
+  if (opts) Sunlock_object((void*)opts);
   freeaddrinfo(info);
   errno = saved_errno;
 
@@ -253,12 +384,16 @@ int ss_connect_to_ipv6_host_impl(const char* address, const char* service,
 
 // arguments: if 'blocking' is false, the file descriptor is set
 // non-blocking and this function may return before the connection is
-// made.
+// made.  opts is an array of opts_count option pairs to be applied to
+// the socket before connecting, or NULL.  TCP level options in it are
+// ignored.
 
 // return value: file descriptor of socket, or -1 if 'pathname' is too
 // long for the socket implementation, -2 on failure to construct a
-// socket, -3 on a failure to connect with blocking true.
-int ss_connect_to_unix_host_impl(const char* pathname, int blocking) {
+// socket, -3 on a failure to connect with blocking true, and -4 on a
+// failure to set the socket options.
+int ss_connect_to_unix_host_impl(const char* pathname, int blocking,
+				 const unsigned char* opts, int opts_count) {
 
   struct sockaddr_un addr;
   memset(&addr, 0, sizeof(addr));
@@ -272,6 +407,7 @@ int ss_connect_to_unix_host_impl(const char* pathname, int blocking) {
   strcpy(addr.sun_path, pathname);
 
   // connect may show latency - release the GC
+  if (opts) Slock_object((void*)opts);
   Sdeactivate_thread();
 
   int saved_errno = 0;
@@ -294,6 +430,11 @@ int ss_connect_to_unix_host_impl(const char* pathname, int blocking) {
       close(sock);
       err = -2;
     }
+    else if (opts && !apply_socket_options(sock, opts, opts_count, 0)) {
+      saved_errno = errno;
+      close(sock);
+      err = -4;
+    }
   }
 
   if (!err) {
@@ -309,6 +450,7 @@ int ss_connect_to_unix_host_impl(const char* pathname, int blocking) {
   }
 
   Sactivate_thread();
+  if (opts) Sunlock_object((void*)opts);
   errno = saved_errno;
 
   if (err) return err;
@@ -318,12 +460,16 @@ int ss_connect_to_unix_host_impl(const char* pathname, int blocking) {
 // arguments: address must be a string in decimal dotted notation
 // giving the address to bind the socket to.  If address is NULL, the
 // socket will bind on any interface.  port is the port to listen on.
-// backlog is the maximum number of queueing connections.
+// backlog is the maximum number of queueing connections.  opts is an
+// array of opts_count option pairs to be applied to the socket before
+// binding, or NULL.
 
 // return value: file descriptor of socket, or -1 on failure to make
 // an address, -2 on failure to create a socket, -3 on a failure to
-// bind to the socket, and -4 on a failure to listen on the socket.
-int ss_listen_on_ipv4_socket_impl(const char* address, unsigned short port, int backlog) {
+// bind to the socket, -4 on a failure to listen on the socket, and -5
+// on a failure to set the socket options.
+int ss_listen_on_ipv4_socket_impl(const char* address, unsigned short port, int backlog,
+				  const unsigned char* opts, int opts_count) {
 
   struct sockaddr_in addr;
   memset(&addr, 0, sizeof(addr));
@@ -350,6 +496,13 @@ int ss_listen_on_ipv4_socket_impl(const char* address, unsigned short port, int
   // we don't need to check the return value of setsockopt() here
   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
+  if (opts && !apply_socket_options(sock, opts, opts_count, 1)) {
+    int saved_errno = errno;
+    close(sock);
+    errno = saved_errno;
+    return -5;
+  }
+
   addr.sin_port = htons(port);
     
   if ((bind(sock, (struct sockaddr*)&addr, sizeof(addr))) == -1) {
@@ -372,12 +525,16 @@ int ss_listen_on_ipv4_socket_impl(const char* address, unsigned short port, int
 // arguments: address must be a string in colonned hex notation giving
 // the address to bind the socket to.  If address is NULL, the socket
 // will bind on any interface.  port is the port to listen on.
-// backlog is the maximum number of queueing connections.
+// backlog is the maximum number of queueing connections.  opts is an
+// array of opts_count option pairs to be applied to the socket before
+// binding, or NULL.
 
 // return value: file descriptor of socket, or -1 on failure to make
 // an address, -2 on failure to create a socket, -3 on a failure to
-// bind to the socket, and -4 on a failure to listen on the socket.
-int ss_listen_on_ipv6_socket_impl(const char* address, unsigned short port, int backlog) {
+// bind to the socket, -4 on a failure to listen on the socket, and -5
+// on a failure to set the socket options.
+int ss_listen_on_ipv6_socket_impl(const char* address, unsigned short port, int backlog,
+				  const unsigned char* opts, int opts_count) {
 
   struct sockaddr_in6 addr;
   memset(&addr, 0, sizeof(addr));
@@ -404,6 +561,13 @@ int ss_listen_on_ipv6_socket_impl(const char* address, unsigned short port, int
   // we don't need to check the return value of setsockopt() here
   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
+  if (opts && !apply_socket_options(sock, opts, opts_count, 1)) {
+    int saved_errno = errno;
+    close(sock);
+    errno = saved_errno;
+    return -5;
+  }
+
   addr.sin6_port = htons(port);
     
   if ((bind(sock, (struct sockaddr*)&addr, sizeof(addr))) == -1) {
@@ -427,13 +591,17 @@ int ss_listen_on_ipv6_socket_impl(const char* address, unsigned short port, int
 // If error_on_existing is true, any existing or stale socket or other
 // file by the name of pathname will cause an error to arise when the
 // unix domain socket is bound.  If false (the default), then any
-// prior existing socket will be deleted before binding.
+// prior existing socket will be deleted before binding.  opts is an
+// array of opts_count option pairs to be applied to the socket before
+// binding, or NULL.  TCP level options in it are ignored.
 
 // return value: file descriptor of socket, or -1 if 'pathname' is too
 // long for the socket implementation, -2 on failure to create a
-// socket, -3 on a failure to bind to the socket, and -4 on a failure
-// to listen on the socket.
-int ss_listen_on_unix_socket_impl(const char* pathname, int backlog, int error_on_existing) {
+// socket, -3 on a failure to bind to the socket, -4 on a failure to
+// listen on the socket, and -5 on a failure to set the socket
+// options.
+int ss_listen_on_unix_socket_impl(const char* pathname, int backlog, int error_on_existing,
+				  const unsigned char* opts, int opts_count) {
 
   struct sockaddr_un addr;
   memset(&addr, 0, sizeof(addr));
@@ -457,6 +625,13 @@ int ss_listen_on_unix_socket_impl(const char* pathname, int backlog, int error_o
   // can do: linux-specific versions of socket() to avoid this are
   // probably not a good idea
   fcntl(sock, F_SETFD, fcntl(sock, F_GETFD) | FD_CLOEXEC);
+
+  if (opts && !apply_socket_options(sock, opts, opts_count, 0)) {
+    int saved_errno = errno;
+    close(sock);
+    errno = saved_errno;
+    return -5;
+  }
     
   if ((bind(sock, (struct sockaddr*)&addr, sizeof(addr))) == -1) {
     int saved_errno = errno;
@@ -479,11 +654,14 @@ int ss_listen_on_unix_socket_impl(const char* pathname, int backlog, int error_o
 // accept connections, as returned by listen_on_ipv4_socket.
 // connection is an array of size 4 in which the binary address of the
 // connecting client will be placed in network byte order, or NULL.
+// opts is an array of opts_count option pairs to be applied to the
+// connection socket, or NULL.
 
 // return value: file descriptor for the connection on success, -1 on
-// failure or -2 if EAGAIN or EWOULDBLOCK encountered on non-blocking
-// socket.
-int ss_accept_ipv4_connection_impl(int sock, uint32_t* connection) {
+// failure, -2 if EAGAIN or EWOULDBLOCK encountered on non-blocking
+// socket, or -3 on a failure to set the socket options.
+int ss_accept_ipv4_connection_impl(int sock, uint32_t* connection,
+				   const unsigned char* opts, int opts_count) {
 
   struct sockaddr_in addr;
   memset(&addr, 0, sizeof(addr));
@@ -522,6 +700,12 @@ int ss_accept_ipv4_connection_impl(int sock, uint32_t* connection) {
       return -2;
     return -1;
   }
+  if (opts && !apply_socket_options(connect_sock, opts, opts_count, 1)) {
+    saved_errno = errno;
+    close(connect_sock);
+    errno = saved_errno;
+    return -3;
+  }
   if (connection) memcpy(connection, &addr.sin_addr.s_addr, sizeof(uint32_t));
   return connect_sock;
 }
@@ -531,11 +715,14 @@ int ss_accept_ipv4_connection_impl(int sock, uint32_t* connection) {
 // connection is an array of size 16 in which the binary address of
 // the connecting client will be placed in network byte order, or
 // NULL.
+// opts is an array of opts_count option pairs to be applied to the
+// connection socket, or NULL.
 
 // return value: file descriptor for the connection on success, -1 on
-// failure or -2 if EAGAIN or EWOULDBLOCK encountered on non-blocking
-// socket.
-int ss_accept_ipv6_connection_impl(int sock, uint8_t* connection) {
+// failure, -2 if EAGAIN or EWOULDBLOCK encountered on non-blocking
+// socket, or -3 on a failure to set the socket options.
+int ss_accept_ipv6_connection_impl(int sock, uint8_t* connection,
+				   const unsigned char* opts, int opts_count) {
 
   struct sockaddr_in6 addr;
   memset(&addr, 0, sizeof(addr));
@@ -574,17 +761,25 @@ int ss_accept_ipv6_connection_impl(int sock, uint8_t* connection) {
       return -2;
     return -1;
   }
+  if (opts && !apply_socket_options(connect_sock, opts, opts_count, 1)) {
+    saved_errno = errno;
+    close(connect_sock);
+    errno = saved_errno;
+    return -3;
+  }
   if (connection) memcpy(connection, &addr.sin6_addr.s6_addr, sizeof(addr.sin6_addr.s6_addr));
   return connect_sock;
 }
 
 // argument: sock is the file descriptor of the socket on which to
-// accept connections, as returned by listen_on_unix_socket.
+// accept connections, as returned by listen_on_unix_socket.  opts is
+// an array of opts_count option pairs to be applied to the connection
+// socket, or NULL.  TCP level options in it are ignored.
 
 // return value: file descriptor for the connection on success, -1 on
-// failure or -2 if EAGAIN or EWOULDBLOCK encountered on non-blocking
-// socket.
-int ss_accept_unix_connection_impl(int sock) {
+// failure, -2 if EAGAIN or EWOULDBLOCK encountered on non-blocking
+// socket, or -3 on a failure to set the socket options.
+int ss_accept_unix_connection_impl(int sock, const unsigned char* opts, int opts_count) {
 
   struct sockaddr_un addr;
   memset(&addr, 0, sizeof(addr));
@@ -621,6 +816,12 @@ int ss_accept_unix_connection_impl(int sock) {
       return -2;
     return -1;
   }
+  if (opts && !apply_socket_options(connect_sock, opts, opts_count, 0)) {
+    saved_errno = errno;
+    close(connect_sock);
+    errno = saved_errno;
+    return -3;
+  }
   return connect_sock;
 }
 